@@ -11,16 +11,29 @@
 #ifndef ABORT_INCLUDE_ABORT_ABORT_H_
 #define ABORT_INCLUDE_ABORT_ABORT_H_
 
+#include <atomic>
 #include <cstddef>
 #include <cstdio>
 #include <memory>
 #include <ostream>
 #include <string>
+#include <string_view>
+#include <type_traits>
 
 #ifndef DOXYGEN_SKIP
 #if defined(_WIN32) || defined(_WIN64)
 #define __PRETTY_FUNCTION__ __FUNCSIG__
 #endif
+
+#if defined(__GNUC__)
+#define ABORT_LIKELY(x)   __builtin_expect(!!(x), 1)
+#define ABORT_UNLIKELY(x) __builtin_expect(!!(x), 0)
+#define ABORT_COLD        __attribute__((cold, noinline))
+#else
+#define ABORT_LIKELY(x)   (x)
+#define ABORT_UNLIKELY(x) (x)
+#define ABORT_COLD
+#endif
 #endif  // DOXYGEN_SKIP
 
 namespace diagnostics {
@@ -28,32 +41,43 @@ namespace diagnostics {
 #ifndef DOXYGEN_SKIP
 namespace internal {
 
-extern std::string buffer;
-extern int         frame_cnt;
+extern std::atomic<bool>              enabled;
+extern thread_local int               frame_cnt;
+extern thread_local std::string       pending;
+
+ABORT_COLD
+void flush_pending();
 
 /**
- * Get the number of arguments passed to a variadic macro
+ * Get the number of arguments passed to a variadic macro. Only ever
+ * used in an unevaluated context, so the argument expressions are
+ * never executed and no definition is required
  *
  * @tparam T The macro argument types
  *
- * @param[in] args The macro input arguments
- *
- * @return The number of arguments
+ * @return An integral constant carrying the number of arguments
  */
 template <typename... T>
-int get_abort_nargs(T&& ... args) { return sizeof...(T); }
+std::integral_constant<int, static_cast<int>(sizeof...(T))>
+get_abort_nargs(T&&...) noexcept;
 
-void errno_msg(const char* select, const char* expr, const char* ret,
-             int frame_cnt, const char* file, int line, const char* func);
+ABORT_COLD
+std::string make_site(const char* file, int line, const char* func);
 
-void print_msg(const char* select, int num_args, const char* cond,
-               const char* ret, int frame_cnt, const char* file, int line,
-               const char* func, const std::string& msg);
+ABORT_COLD
+void errno_msg(const char* default_msg, int frame_cnt,
+               const std::string& site);
+
+ABORT_COLD
+void fire(const char* default_msg, int num_args, int frame,
+          const std::string& site, const char* fmt, ...);
 
 }  // namespace internal
 #endif
 
+void          flush();
 std::ostream& get_ostream();
+void          set_enabled(bool value);
 void          set_message_size(std::size_t size);
 void          set_ostream(std::shared_ptr<std::ostream> os);
 
@@ -62,9 +86,11 @@ void          set_ostream(std::shared_ptr<std::ostream> os);
 /**
  * @def ABORT_N_ARGS(...)
  *
- * Get the number of arguments passed to a variadic macro
+ * Get the number of arguments passed to a variadic macro as a
+ * compile-time constant. The arguments themselves are not evaluated
  */
-#define ABORT_N_ARGS(...) diagnostics::internal::get_abort_nargs(__VA_ARGS__)
+#define ABORT_N_ARGS(...) \
+    decltype(diagnostics::internal::get_abort_nargs(__VA_ARGS__))::value
 
 /**
  * @def ABORT_IF(cond, ret, ...)
@@ -74,27 +100,29 @@ void          set_ostream(std::shared_ptr<std::ostream> os);
  * with the return value \a ret. Any additional arguments will be used
  * to construct an error message
  */
-#define ABORT_IF(cond, ret, ...) {                                            \
+#define ABORT_IF(cond, ret, ...) do {                                         \
     diagnostics::internal::frame_cnt++;                                       \
-    if (cond) {                                                               \
-        std::string message = diagnostics::internal::buffer;                  \
-        if (!message.empty()) {                                               \
-            std::snprintf(&message.at(0), message.size(), " " __VA_ARGS__);   \
+    if (ABORT_UNLIKELY(cond)) {                                               \
+        if (ABORT_LIKELY(diagnostics::internal::enabled.load(                 \
+                std::memory_order_relaxed))) {                                \
+            static const std::string abort_site_ =                            \
+                diagnostics::internal::make_site(__FILE__, __LINE__,          \
+                                                 __PRETTY_FUNCTION__);        \
+            diagnostics::internal::fire("ABORT_IF(" #cond ", " #ret ");", \
+                                        ABORT_N_ARGS(__VA_ARGS__),            \
+                                        diagnostics::internal::frame_cnt-1,   \
+                                        abort_site_,                          \
+                                        " " __VA_ARGS__);                     \
         }                                                                     \
-        diagnostics::internal::print_msg("ABORT_IF",                          \
-                                         ABORT_N_ARGS(__VA_ARGS__),           \
-                                         #cond, #ret,                         \
-                                         diagnostics::internal::frame_cnt-1,  \
-                                         __FILE__,                            \
-                                         __LINE__,                            \
-                                         __PRETTY_FUNCTION__,                 \
-                                         message);                            \
         diagnostics::internal::frame_cnt--;                                   \
         return (ret);                                                         \
-    } else {                                                                  \
-        diagnostics::internal::frame_cnt--;                                   \
     }                                                                         \
-}
+    diagnostics::internal::frame_cnt--;                                       \
+    if (ABORT_UNLIKELY(diagnostics::internal::frame_cnt == 0 &&               \
+                       !diagnostics::internal::pending.empty())) {            \
+        diagnostics::internal::flush_pending();                               \
+    }                                                                         \
+} while (0)
 
  /**
   * @def ABORT(ret, ...)
@@ -104,23 +132,20 @@ void          set_ostream(std::shared_ptr<std::ostream> os);
   * additional arguments (optional) will be used to create an error
   * message
   */
-#define ABORT(ret, ...) {                                                 \
-    diagnostics::internal::frame_cnt++;                                   \
-    std::string message = diagnostics::internal::buffer;                  \
-    if (!message.empty()) {                                               \
-        std::snprintf(&message.at(0), message.size(), " " __VA_ARGS__);   \
-    }                                                                     \
-    diagnostics::internal::print_msg("ABORT",                             \
-                                     ABORT_N_ARGS(__VA_ARGS__),           \
-                                     "", #ret,                            \
-                                     diagnostics::internal::frame_cnt-1,  \
-                                     __FILE__,                            \
-                                     __LINE__,                            \
-                                     __PRETTY_FUNCTION__,                 \
-                                     message);                            \
-    diagnostics::internal::frame_cnt--;                                   \
-    return (ret);                                                         \
-}
+#define ABORT(ret, ...) do {                                                  \
+    if (ABORT_LIKELY(diagnostics::internal::enabled.load(                     \
+            std::memory_order_relaxed))) {                                    \
+        static const std::string abort_site_ =                                \
+            diagnostics::internal::make_site(__FILE__, __LINE__,              \
+                                             __PRETTY_FUNCTION__);            \
+        diagnostics::internal::fire("ABORT(" #ret ");",                       \
+                                    ABORT_N_ARGS(__VA_ARGS__),                \
+                                    diagnostics::internal::frame_cnt,         \
+                                    abort_site_,                              \
+                                    " " __VA_ARGS__);                         \
+    }                                                                         \
+    return (ret);                                                             \
+} while (0)
 
  /**
   * @def ABORT_IF_NOT(cond, ret, ...)
@@ -130,27 +155,29 @@ void          set_ostream(std::shared_ptr<std::ostream> os);
   * with the return value \a ret. Any additional arguments will be used
   * to construct an error message
   */
-#define ABORT_IF_NOT(cond, ret, ...) {                                        \
+#define ABORT_IF_NOT(cond, ret, ...) do {                                     \
     diagnostics::internal::frame_cnt++;                                       \
-    if (!(cond)) {                                                            \
-        std::string message = diagnostics::internal::buffer;                  \
-        if (!message.empty()) {                                               \
-            std::snprintf(&message.at(0), message.size(), " " __VA_ARGS__);   \
+    if (ABORT_UNLIKELY(!(cond))) {                                            \
+        if (ABORT_LIKELY(diagnostics::internal::enabled.load(                 \
+                std::memory_order_relaxed))) {                                \
+            static const std::string abort_site_ =                            \
+                diagnostics::internal::make_site(__FILE__, __LINE__,          \
+                                                 __PRETTY_FUNCTION__);        \
+            diagnostics::internal::fire("ABORT_IF_NOT(" #cond ", " #ret ");",\
+                                        ABORT_N_ARGS(__VA_ARGS__),            \
+                                        diagnostics::internal::frame_cnt-1,   \
+                                        abort_site_,                          \
+                                        " " __VA_ARGS__);                     \
         }                                                                     \
-        diagnostics::internal::print_msg("ABORT_IF_NOT",                      \
-                                         ABORT_N_ARGS(__VA_ARGS__),           \
-                                         #cond, #ret,                         \
-                                         diagnostics::internal::frame_cnt-1,  \
-                                         __FILE__,                            \
-                                         __LINE__,                            \
-                                         __PRETTY_FUNCTION__,                 \
-                                         message);                            \
         diagnostics::internal::frame_cnt--;                                   \
         return (ret);                                                         \
-    } else {                                                                  \
-        diagnostics::internal::frame_cnt--;                                   \
     }                                                                         \
-}
+    diagnostics::internal::frame_cnt--;                                       \
+    if (ABORT_UNLIKELY(diagnostics::internal::frame_cnt == 0 &&               \
+                       !diagnostics::internal::pending.empty())) {            \
+        diagnostics::internal::flush_pending();                               \
+    }                                                                         \
+} while (0)
 
 /**
   * @def ABORT_ON_ERRNO(expr, ret)
@@ -160,20 +187,27 @@ void          set_ostream(std::shared_ptr<std::ostream> os);
   * exit with the return value \a ret. An error message is constructed
   * based on the value of errno
   */
-#define ABORT_ON_ERRNO(expr, ret) {                                           \
+#define ABORT_ON_ERRNO(expr, ret) do {                                        \
     diagnostics::internal::frame_cnt++;                                       \
-    if ((expr) == -1) {                                                       \
-        diagnostics::internal::errno_msg("ABORT_ON_ERRNO",                    \
-                                         #expr, #ret,                         \
-                                         diagnostics::internal::frame_cnt-1,  \
-                                         __FILE__,                            \
-                                         __LINE__,                            \
-                                         __PRETTY_FUNCTION__);                \
+    if (ABORT_UNLIKELY((expr) == -1)) {                                       \
+        if (ABORT_LIKELY(diagnostics::internal::enabled.load(                 \
+                std::memory_order_relaxed))) {                                \
+            static const std::string abort_site_ =                            \
+                diagnostics::internal::make_site(__FILE__, __LINE__,          \
+                                                 __PRETTY_FUNCTION__);        \
+            diagnostics::internal::errno_msg(                                 \
+                "ABORT_ON_ERRNO(" #expr ", " #ret ");",                       \
+                diagnostics::internal::frame_cnt-1,                           \
+                abort_site_);                                                 \
+        }                                                                     \
         diagnostics::internal::frame_cnt--;                                   \
         return (ret);                                                         \
-    } else {                                                                  \
-        diagnostics::internal::frame_cnt--;                                   \
     }                                                                         \
-}
+    diagnostics::internal::frame_cnt--;                                       \
+    if (ABORT_UNLIKELY(diagnostics::internal::frame_cnt == 0 &&               \
+                       !diagnostics::internal::pending.empty())) {            \
+        diagnostics::internal::flush_pending();                               \
+    }                                                                         \
+} while (0)
 
 #endif  // ABORT_INCLUDE_ABORT_ABORT_H_
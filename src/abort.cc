@@ -10,9 +10,17 @@
 
 #include "abort/abort.h"
 
+#include <algorithm>
 #include <cerrno>
+#include <charconv>
+#include <cstdarg>
 #include <cstring>
 #include <iostream>
+#include <mutex>
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <unistd.h>
+#endif
 
 namespace diagnostics {
 
@@ -21,96 +29,365 @@ namespace internal {
 
 /**
  * The stream to which messages are written. All messages are by default
- * written to standard output
+ * written to standard output. This holds ownership only; the abort path
+ * reads \ref stream_ptr instead so that it never touches the shared_ptr
+ * control block
  */
 std::shared_ptr<std::ostream> stream;
 
 /**
- * The buffer to which messages are formatted before being placed on the
- * output stream
+ * Raw pointer to the active output stream, updated by set_ostream().
+ * Null until the first access, at which point it is pointed at a
+ * std::cout-backed default
+ */
+std::atomic<std::ostream*> stream_ptr{nullptr};
+
+/**
+ * Serializes writes to the output stream so that messages emitted from
+ * different threads do not interleave
+ */
+std::mutex stream_mutex;
+
+/**
+ * The file descriptor underlying the active stream when it wraps
+ * standard output (the default) or standard error, or -1 when the user
+ * installed a custom stream. A non-negative value lets the emit path
+ * hand bytes straight to write(2) instead of going through iostreams
+ */
+std::atomic<int> stream_fd{1};
+
+/**
+ * Per-thread staging area in which messages are assembled before being
+ * written to the output stream. During a cascading abort, one line per
+ * stack frame accumulates here so the whole trace can be written in a
+ * single call once the outermost frame has been emitted
+ */
+thread_local std::string pending;
+
+/**
+ * The per-thread buffer to which messages are formatted before being
+ * placed on the output stream. Each thread formats into its own copy,
+ * so no synchronization is needed around snprintf()
+ */
+thread_local std::string buffer(1024, '\0');
+
+/**
+ * The size of \ref buffer in bytes, shared by all threads. Stored
+ * atomically so that set_message_size() can publish a new size which
+ * each thread picks up on its next abort
+ */
+std::atomic<std::size_t> message_size{1024};
+
+/**
+ * True if the user requested an explicit message size limit through
+ * set_message_size(). Until then, the buffer grows to fit whatever
+ * message is formatted into it
+ */
+std::atomic<bool> size_fixed{false};
+
+/**
+ * Flag indicating whether diagnostic output is enabled. When cleared,
+ * the abort macros skip message formatting and emission entirely
+ */
+std::atomic<bool> enabled{true};
+
+/**
+ * The currently executing function's distance to the bottom of the call
+ * stack. Thread-local so that concurrently aborting threads each track
+ * their own depth. The conditional macros must increment this before
+ * evaluating their condition, since aborts fired from functions called
+ * by the condition itself need to see the enclosing activation
  */
-std::string buffer(1024, '\0');
+thread_local int frame_cnt = 0;
 
 /**
- * The currently executing function's distance to the bottom of the call stack
+ * Get the calling thread's message buffer, resized if needed to the
+ * size most recently requested via set_message_size()
+ *
+ * @return The thread-local message buffer
  */
-int frame_cnt = 0;
+std::string& get_buffer() {
+    const std::size_t size = message_size.load(std::memory_order_relaxed);
+    if (buffer.size() != size) {
+        // The allocator rounds requests up to its size class anyway, so
+        // reserve the 16-byte-aligned capacity to keep a later regrowth
+        // within the same allocation. The logical size stays exact since
+        // it defines the truncation point
+        buffer.reserve((size + 15) & ~std::size_t(15));
+        buffer.resize(size, '\0');
+    }
+    return buffer;
+}
+
+/**
+ * Format printf()-style text into \a buf. If the formatted message does
+ * not fit, and no explicit limit was set via set_message_size(), the
+ * buffer is grown using the size reported by vsnprintf() and formatting
+ * is repeated; otherwise the message is truncated to the limit
+ *
+ * @param[in,out] buf  The buffer to format into
+ * @param[in]     fmt  A printf()-style format string
+ * @param[in]     args Arguments matching \a fmt
+ *
+ * @return The number of characters written, excluding the null
+ *         terminator
+ */
+static int vformat_into(std::string& buf, const char* fmt,
+                        std::va_list args) {
+    std::va_list retry;
+    va_copy(retry, args);
+
+    int needed = std::vsnprintf(buf.empty() ? nullptr : &buf.at(0),
+                                buf.size(), fmt, args);
+
+    if (needed >= 0 && static_cast<std::size_t>(needed) >= buf.size() &&
+        !size_fixed.load(std::memory_order_relaxed)) {
+        // Grow geometrically so repeated expansion stays amortized, now
+        // that the required size is known
+        buf.resize(std::max<std::size_t>(needed + 1, (buf.size()*3)/2), '\0');
+        needed = std::vsnprintf(&buf.at(0), buf.size(), fmt, retry);
+    }
+    va_end(retry);
+
+    if (needed < 0 || buf.empty()) {
+        return 0;
+    }
+    return std::min<std::size_t>(needed, buf.size()-1);
+}
+
+/**
+ * Append printf()-style formatted text to \a out, growing it as needed
+ *
+ * @param[in,out] out The string to append to
+ * @param[in]     fmt A printf()-style format string
+ */
+static void append_format(std::string& out, const char* fmt, ...) {
+    std::va_list args, retry;
+    va_start(args, fmt);
+    va_copy(retry, args);
+
+    const std::size_t used = out.size();
+    out.resize(used + 128, '\0');
+
+    int needed = std::vsnprintf(&out.at(used), out.size() - used, fmt, args);
+    va_end(args);
+
+    if (needed >= 0 && static_cast<std::size_t>(needed) >= out.size() - used) {
+        out.resize(used + needed + 1, '\0');
+        needed = std::vsnprintf(&out.at(used), out.size() - used, fmt, retry);
+    }
+    va_end(retry);
+
+    out.resize(needed > 0 ? used + needed : used);
+}
+
+/**
+ * Append the base-10 representation of \a value to \a out. Unlike
+ * snprintf(), no format string is parsed for a value that is trivially
+ * convertible
+ *
+ * @param[in,out] out   The string to append to
+ * @param[in]     value The value to append
+ */
+static void append_int(std::string& out, int value) {
+    char digits[12];
+    const auto res = std::to_chars(digits, digits + sizeof(digits), value);
+    out.append(digits, res.ptr - digits);
+}
+
+/**
+ * Build the fixed portion of a call site's message prefix. The file,
+ * line, and function are compile-time constants at each call site, so
+ * the macros invoke this once per site via a static local
+ *
+ * @param[in] file The name of the file containing the call site
+ * @param[in] line The line number of the call site
+ * @param[in] func Function (or method) containing the call site
+ *
+ * @return The formatted site prefix
+ */
+std::string make_site(const char* file, int line, const char* func) {
+    std::string site;
+    append_format(site, "%s:%d: In '%s':", file, line, func);
+    return site;
+}
+
+/**
+ * Write a fully formatted message to the output target. When the
+ * active stream wraps standard output or standard error the bytes are
+ * handed directly to write(2), skipping iostream sentry and locale
+ * machinery; otherwise they go through the stream
+ *
+ * @param[in] out The message to write
+ */
+static void write_out(const std::string& out) {
+    std::lock_guard<std::mutex> lock(stream_mutex);
+#if !defined(_WIN32) && !defined(_WIN64)
+    const int fd = stream_fd.load(std::memory_order_relaxed);
+    if (fd >= 0) {
+        if (::write(fd, out.data(), out.size()) == -1) {
+            // Diagnostic output is best-effort; nothing to do here
+        }
+        return;
+    }
+#endif
+    std::ostream& os = get_ostream();
+    os.write(out.data(), out.size());
+}
+
+/**
+ * Write the calling thread's accumulated frames to the output target
+ * and reset the accumulator. A cascading abort buffers one line per
+ * frame, so flushing only once the outermost frame has been emitted
+ * turns an N-frame stack trace into a single write
+ */
+void flush_pending() {
+    write_out(pending);
+    pending.clear();
+}
 
 /**
  * Write an abort message to the output stream for a syscall error
  *
- * @param[in] select    The selected macro
- * @param[in] expr      The system call that returned -1
- * @param[in] ret       The function/method return value
- * @param[in] frame_cnt Current distance to the bottom of the call stack
- * @param[in] file      The name of the file from which this message originated
- * @param[in] line      The line number at which this message originated
- * @param[in] func      Function (or method) from which this message originated
- *
- */
-void errno_msg(const char* select, const char* expr, const char* ret,
-             int frame_cnt, const char* file, int line, const char* func) {
-    get_ostream() << "abort[" << frame_cnt << "]: " << file << ":" << line
-                  << ": In '" << func << "': " << select << "(" << expr << ", "
-                  << ret << "); " << std::strerror(errno)
-                  << std::endl;
+ * @param[in] default_msg The stringified macro invocation, assembled as
+ *                        a single literal at the call site
+ * @param[in] frame_cnt   Current distance to the bottom of the call stack
+ * @param[in] site        The call site prefix built by make_site()
+ *
+ */
+void errno_msg(const char* default_msg, int frame_cnt,
+               const std::string& site) {
+    std::string& out = pending;
+    out.append("abort[");
+    append_int(out, frame_cnt);
+    out.append("]: ");
+    out.append(site);
+    out.push_back(' ');
+    out.append(default_msg);
+    out.push_back(' ');
+    out.append(std::strerror(errno));
+    out.push_back('\n');
+
+    if (frame_cnt == 0) {
+        flush_pending();
+    }
 }
 
 /**
  * Write an abort message to the output stream
  *
- * @param[in] select    The selected macro
- * @param[in] num_args  Number of macro arguments passed
- * @param[in] cond      The condition that triggered the abort
- * @param[in] ret       The function/method return value
- * @param[in] frame_cnt Current distance to the bottom of the call stack
- * @param[in] file      The name of the file from which this message originated
- * @param[in] line      The line number at which this message originated
- * @param[in] func      Function (or method) from which this message originated
- * @param[in] msg       A custom message passed to an abort macro
+ * @param[in] default_msg The stringified macro invocation, assembled as
+ *                        a single literal at the call site
+ * @param[in] num_args    Number of macro arguments passed
+ * @param[in] frame_cnt   Current distance to the bottom of the call stack
+ * @param[in] site        The call site prefix built by make_site()
+ * @param[in] msg         A custom message passed to an abort macro
  *
  */
-void print_msg(const char* select, int num_args, const char* cond,
-               const char* ret, int frame_cnt, const char* file, int line,
-               const char* func, const std::string& msg) {
-    get_ostream() << "abort[" << frame_cnt << "]: " << file << ":" << line
-                  << ": In '" << func << "':";
+static void print_msg(const char* default_msg, int num_args, int frame_cnt,
+                      const std::string& site, std::string_view msg) {
+    std::string& out = pending;
+    out.append("abort[");
+    append_int(out, frame_cnt);
+    out.append("]: ");
+    out.append(site);
 
     if (num_args == 0) {
-        get_ostream() << " " << select << "(" << cond
-                      << (std::string(cond).empty() ? "" : ", ") << ret << ");"
-                      << std::endl;
+        out.push_back(' ');
+        out.append(default_msg);
     } else {
-        get_ostream() << msg << std::endl;
+        out.append(msg);
+    }
+    out.push_back('\n');
+
+    if (frame_cnt == 0) {
+        flush_pending();
+    }
+}
+
+/**
+ * Format the user message (if any) and emit the full diagnostic line.
+ * This is the out-of-line common tail of the formatted abort macros,
+ * keeping each call site down to a test and a call
+ *
+ * @param[in] default_msg The stringified macro invocation, assembled as
+ *                        a single literal at the call site
+ * @param[in] num_args    Number of macro arguments passed
+ * @param[in] frame       Current distance to the bottom of the call stack
+ * @param[in] site        The call site prefix built by make_site()
+ * @param[in] fmt         A printf()-style format string for the user message
+ */
+void fire(const char* default_msg, int num_args, int frame,
+          const std::string& site, const char* fmt, ...) {
+    std::string_view msg;
+
+    // With no user-supplied arguments the default message is printed
+    // instead, so skip the formatting pass altogether
+    if (num_args > 0) {
+        std::string& message = get_buffer();
+
+        std::va_list args;
+        va_start(args, fmt);
+        const int len = vformat_into(message, fmt, args);
+        va_end(args);
+
+        msg = std::string_view(message.data(), len);
     }
+
+    print_msg(default_msg, num_args, frame, site, msg);
 }
 
 }  // namespace internal
 #endif
 
+/**
+ * Flush the output stream. Messages are terminated with '\n' rather
+ * than std::endl to avoid forcing a flush (and the system call it
+ * implies) on every abort; call this to push buffered messages out
+ */
+void flush() {
+    std::lock_guard<std::mutex> lock(internal::stream_mutex);
+    get_ostream().flush();
+}
+
 /**
  * Get the stream object currently being written to
  *
  * @return The output stream
  */
 std::ostream& get_ostream() {
-    if (!internal::stream) {
-        internal::stream = std::make_shared<std::ostream>(
-            std::cout.rdbuf());
+    std::ostream* os = internal::stream_ptr.load(std::memory_order_acquire);
+    if (os == nullptr) {
+        static std::ostream default_stream(std::cout.rdbuf());
+        os = &default_stream;
+        internal::stream_ptr.store(os, std::memory_order_release);
     }
-    return *internal::stream;
+    return *os;
+}
+
+/**
+ * Enable or disable diagnostic output. When disabled, the abort macros
+ * still return control to the caller as usual but skip message
+ * formatting and emission, reducing each macro to a check of this flag
+ *
+ * @param[in] value True to enable output, false to disable it
+ */
+void set_enabled(bool value) {
+    internal::enabled.store(value, std::memory_order_relaxed);
 }
 
 /**
  * Set the maximum size of an output message in bytes. Messages larger
- * than this will be truncated
+ * than this will be truncated. The new size takes effect in each
+ * thread the next time it triggers an abort
  *
  * @param[in] size The message size limit
  */
 void set_message_size(std::size_t size) {
     // Add 1 to account for the leading space in call to snprintf()
     // and the null terminator
-    internal::buffer.resize(size+2);
+    internal::message_size.store(size+2, std::memory_order_relaxed);
+    internal::size_fixed.store(true, std::memory_order_relaxed);
 }
 
 /**
@@ -120,7 +397,24 @@ void set_message_size(std::size_t size) {
  * @return The output stream
  */
 void set_ostream(std::shared_ptr<std::ostream> os) {
-    internal::stream = os;
+    // Taking the output lock ensures no message is mid-write on the
+    // stream being replaced
+    std::lock_guard<std::mutex> lock(internal::stream_mutex);
+    internal::stream = std::move(os);
+    internal::stream_ptr.store(internal::stream.get(),
+                               std::memory_order_release);
+
+    // Track the file descriptor behind the stream so the emit path can
+    // write(2) directly when the target is standard output or standard
+    // error. A null stream falls back to the std::cout-backed default
+    int fd = -1;
+    if (!internal::stream ||
+        internal::stream->rdbuf() == std::cout.rdbuf()) {
+        fd = 1;
+    } else if (internal::stream->rdbuf() == std::cerr.rdbuf()) {
+        fd = 2;
+    }
+    internal::stream_fd.store(fd, std::memory_order_relaxed);
 }
 
 }  // namespace diagnostics
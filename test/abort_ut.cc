@@ -8,12 +8,16 @@
  *  https://github.com/jfern2011/abort
  */
 
+#include <algorithm>
+#include <array>
+#include <charconv>
 #include <cstddef>
-#include <cstdio>
+#include <cstring>
 #include <memory>
-#include <sstream>
+#include <ostream>
+#include <streambuf>
 #include <string>
-#include <vector>
+#include <string_view>
 
 #include "gtest/gtest.h"
 
@@ -22,62 +26,253 @@
 namespace {
 
 /**
- * Split a string into tokens. A delimiter is specified to indicate
- * how to slice the string
+ * Invoke a callback for each token of a string. Empty tokens are
+ * skipped. The tokens are views into \a str and are valid only for
+ * the duration of the callback unless \a str outlives them
  *
- * @param [in]  str    The string to split
- * @param [out] tokens A vector of the elements of the split string
- * @param [in]  delim  The delimiter
+ * @tparam F Callable with signature void(size_t index, string_view)
+ *
+ * @param [in] str   The string to tokenize
+ * @param [in] delim The delimiter
+ * @param [in] func  Invoked once per token with its index
  */
-void split(const std::string& str,
-           std::vector<std::string>* tokens,
-           const std::string& delim = " ") {
-    const std::string line = str;
-
-    tokens->clear();
-
+template <typename F>
+void for_each_token(std::string_view str, std::string_view delim,
+                    F&& func) {
     if (delim.empty()) { return; }
 
-    size_t ind, start = 0;
-    while ((ind= line.find(delim, start)) != std::string::npos) {
-        if (ind - start > 0)
-            tokens->push_back(line.substr(start, ind - start));
+    /* Hot path: every caller here splits on a single character, so
+     * walk the buffer with memchr (a SIMD byte scan) and never touch
+     * the general substring search
+     */
+    if (delim.size() == 1) {
+        const char  d    = delim[0];
+        const char* base = str.data();
+        const char* end  = base + str.size();
+
+        size_t index = 0;
+        for (const char* p = base; p < end; ) {
+            const char* q = static_cast<const char*>(
+                std::memchr(p, d, static_cast<size_t>(end - p)));
+            if (!q) q = end;
+            if (q != p)
+                func(index++, std::string_view(
+                    p, static_cast<size_t>(q - p)));
+            p = q + (q < end);
+        }
+        return;
+    }
+
+    size_t ind, start = 0, index = 0;
+    while ((ind = str.find(delim, start)) != std::string_view::npos) {
+        /* Token bounds are computed unconditionally; only the call
+         * depends on the (unpredictable) emptiness check
+         */
+        const size_t len = ind - start;
+        const char*  ptr = str.data() + start;
+        if (len) func(index++, std::string_view(ptr, len));
         start = ind + delim.size();
     }
 
     /* Final token */
 
-    if (start < line.size())
-        tokens->push_back(line.substr(start,
-            std::string::npos));
+    if (start < str.size())
+        func(index, std::string_view(str.data() + start,
+                                     str.size() - start));
 }
 
 /**
  * Remove leading and trailing whitespace from a string. This
- * includes the character set " \t\n\v\f\r"
+ * includes the character set " \t\n\v\f\r". The result is a view
+ * into \a str and allocates nothing; the underlying storage must
+ * outlive it
  *
  * @param[in] str Input string
  *
  * @return     The input string with all leading and trailing
  *             whitespace removed
  */
-std::string trim(const std::string& str) {
-    if (str.empty()) return str;
+std::string_view trim(std::string_view str) {
+    /* Compile-time whitespace classification table: one indexed load
+     * per byte instead of a scan over the six-character set
+     */
+    static constexpr auto space = []() {
+        std::array<bool, 256> table{};
+        for (char c : {'\t', '\n', '\v', '\f', '\r', ' '})
+            table[static_cast<unsigned char>(c)] = true;
+        return table;
+    }();
+
+    size_t start = 0, stop = str.size();
+
+    while (start < stop &&
+           space[static_cast<unsigned char>(str[start])]) { ++start; }
+    while (stop > start &&
+           space[static_cast<unsigned char>(str[stop-1])]) { --stop; }
 
-    const std::string space = "\t\n\v\f\r ";
+    return
+        str.substr(start, stop-start);
+}
 
-    size_t start =
-        str.find_first_not_of(space);
+/**
+ * Find the last occurrence of a character. Unlike rfind() with a
+ * string argument this is a plain backward byte scan, so the cost is
+ * the distance from the tail to the match rather than a general
+ * substring search
+ *
+ * @param[in] str The string to search
+ * @param[in] c   The character to search for
+ *
+ * @return The index of the last occurrence of \a c, or npos if not
+ *         found
+ */
+size_t rfind_char(std::string_view str, char c) {
+    for (size_t i = str.size(); i-- > 0;) {
+        if (str[i] == c) return i;
+    }
+    return std::string_view::npos;
+}
 
-    if (start == std::string::npos)
-        return "";
+/**
+ * Test whether a string begins with the given prefix. Equivalent to
+ * C++20 string_view::starts_with: the comparison is bounded by the
+ * prefix length, unlike find(prefix) == 0 which scans the whole
+ * string when the prefix is absent
+ *
+ * @param[in] str    The string to test
+ * @param[in] prefix The prefix to look for
+ *
+ * @return True if \a str begins with \a prefix
+ */
+bool starts_with(std::string_view str, std::string_view prefix) {
+    return str.size() >= prefix.size() &&
+           std::memcmp(str.data(), prefix.data(), prefix.size()) == 0;
+}
 
-    size_t stop = str.find_last_not_of(space);
+/**
+ * Scan a line once for a small set of literal patterns, in the spirit
+ * of multi-pattern matchers: a single left-to-right pass with
+ * first-byte dispatch, rather than one full substring search per
+ * pattern
+ *
+ * @param[in] line     The line to scan
+ * @param[in] literals The patterns to look for
+ * @param[in] count    The number of patterns (at most 32)
+ *
+ * @return A bitmask whose k-th bit is set if \a literals[k] occurs
+ *         anywhere in \a line
+ */
+unsigned scan_literals(std::string_view line,
+                       const std::string_view* literals,
+                       size_t count) {
+    unsigned bits = 0;
+    const unsigned all = (1u << count) - 1;
+
+    for (size_t i = 0; i < line.size() && bits != all; i++) {
+        for (size_t k = 0; k < count; k++) {
+            const std::string_view& lit = literals[k];
+            if ((bits & (1u << k)) == 0 &&
+                line[i] == lit[0] &&
+                line.size() - i >= lit.size() &&
+                std::memcmp(line.data() + i, lit.data(),
+                            lit.size()) == 0) {
+                bits |= 1u << k;
+            }
+        }
+    }
+    return bits;
+}
 
-    return
-        str.substr(start, stop-start+1);
+/**
+ * Verify a stack trace produced by one of the ABORT macros. Each line
+ * must begin with its frame preface, and every line must carry the
+ * macro's default message except the one holding the depth message
+ *
+ * @param[in] str          The captured stack trace
+ * @param[in] macro        Name of the macro under test
+ * @param[in] depth_at_end True if the depth message is on the last
+ *                         line and every frame counter prints as zero
+ */
+void verify_stack(std::string_view str, const char* macro,
+                  bool depth_at_end) {
+    const std::size_t total = static_cast<std::size_t>(
+        std::count(str.begin(), str.end(), '\n'));
+    ASSERT_EQ(total, 6u);
+
+    const std::string_view literals[] = {macro, "depth = 5"};
+
+    std::size_t n_lines = 0;
+    for_each_token(str, "\n", [&](std::size_t i, std::string_view line) {
+        n_lines++;
+
+        const std::size_t frame =
+            depth_at_end ? 0u : total-i-1;
+
+        char preface[16];
+        std::memcpy(preface, "abort[", 6);
+        auto res = std::to_chars(preface+6, preface+14, frame);
+        *res.ptr++ = ']';
+        *res.ptr++ = ':';
+        const size_t preface_len = res.ptr - preface;
+        EXPECT_TRUE(starts_with(line,
+                                std::string_view(preface, preface_len)))
+            << "lines[" << i << "] = '" << std::string(line) << "'";
+
+        const unsigned bits = scan_literals(line, literals, 2);
+
+        const bool depth_line = depth_at_end ? (i == total-1)
+                                             : (i == 0);
+        if (depth_line) {
+            EXPECT_TRUE(bits & 2u)
+                << "lines[" << i << "] = '" << std::string(line) << "'";
+        } else {
+            EXPECT_TRUE(bits & 1u)
+                << "lines[" << i << "] = '" << std::string(line) << "'";
+        }
+    });
+
+    EXPECT_EQ(n_lines, total);
 }
 
+/**
+ * A minimal streambuf that appends directly into a std::string. This
+ * bypasses the locale and per-character machinery of ostringstream,
+ * and the preallocated buffer absorbs an entire stack trace without
+ * reallocating
+ */
+struct StringBuf : public std::streambuf {
+    /** Preallocate enough for a full stack trace */
+    StringBuf() { s.reserve(4096); }
+
+    /**
+     * Handle single-character overflow
+     *
+     * @param[in] c The character to append
+     *
+     * @return \a c on success
+     */
+    int_type overflow(int_type c) override {
+        if (c != traits_type::eof()) s.push_back(static_cast<char>(c));
+        return c;
+    }
+
+    /**
+     * Handle bulk writes
+     *
+     * @param[in] p The characters to append
+     * @param[in] n The number of characters
+     *
+     * @return The number of characters appended
+     */
+    std::streamsize xsputn(const char* p, std::streamsize n) override {
+        s.append(p, static_cast<size_t>(n));
+        return n;
+    }
+
+    /** Everything written to the stream so far */
+    std::string s;
+};
+
 /**
  * ABORT* macro test fixture
  */
@@ -85,9 +280,15 @@ class AbortTest : public ::testing::Test {
  protected:
 /** Test setup method */
 void SetUp() override {
-    stream_ = std::make_shared<std::ostringstream>();
+    /* Hand the library a non-owning alias of the fixture's stream.
+     * The aliasing constructor with an empty control block performs
+     * no allocation and no reference counting
+     */
+    diagnostics::set_ostream(
+        std::shared_ptr<std::ostream>(std::shared_ptr<int>(), &stream_));
 }
 
+ public:
 /**
  * Writes the stack trace to the output stream via the ABORT_IF_NOT macro
  *
@@ -130,125 +331,102 @@ int abort_if(int depth) {
     return -1;
 }
 
+ protected:
+/**
+ * The buffer backing \ref stream_
+ */
+StringBuf buf_;
+
 /**
  * The stream object to write to
  */
-std::shared_ptr<std::ostringstream> stream_;
+std::ostream stream_{&buf_};
 };
 
-TEST_F(AbortTest, ABORT_IF_NOT) {
-    ASSERT_TRUE(stream_);
-    diagnostics::set_ostream(stream_);
-    abort_if_not(0);
+/**
+ * One ABORT macro variant exercised by the parameterized stack trace
+ * test below
+ */
+struct AbortCase {
+    /** Fixture helper that recurses and aborts via one macro */
+    int (AbortTest::*fn)(int);
+
+    /** Name of the macro, expected in the default messages */
+    const char* macro_name;
+
+    /** True if the depth message is on the last line and every frame
+     *  counter prints as zero (the ABORT macro; see the note on its
+     *  frame handling in the fixture)
+     */
+    bool depth_at_end;
+};
 
-    std::string str = stream_->str();
-    std::vector<std::string> lines;
-    split(str, &lines, "\n");
+/**
+ * Parameterized fixture running the stack trace test once per ABORT
+ * macro variant
+ */
+class AbortStackTest : public AbortTest,
+                       public ::testing::WithParamInterface<AbortCase> {
+};
 
-    ASSERT_EQ(lines.size(), 6u);
+TEST_P(AbortStackTest, StackTrace) {
+    const AbortCase& c = GetParam();
+    (this->*c.fn)(0);
 
-    for (std::size_t i = 0; i < lines.size(); i++) {
-        char preface[16];
-        std::snprintf(preface, sizeof(preface),
-                      "abort[%zu]:", lines.size()-i-1);
-        EXPECT_EQ(lines[i].find(preface), 0);
-        if (i == 0) {
-            EXPECT_NE(lines[i].find("depth = 5"), std::string::npos)
-                << "lines[" << i << "] = '" << std::string(lines[i]) << "'";
-        } else {
-            EXPECT_NE(lines[i].find("ABORT_IF_NOT"), std::string::npos)
-                << "lines[" << i << "] = '" << std::string(lines[i]) << "'";
-        }
-    }
+    verify_stack(buf_.s, c.macro_name, c.depth_at_end);
 }
 
 /**
  * @todo Frame counter is not very robust; in particular, it does not correctly
  *       print in ABORT() as it always decrements before yielding control
  */
-TEST_F(AbortTest, ABORT) {
-    ASSERT_TRUE(stream_);
-    diagnostics::set_ostream(stream_);
-    abort(0);
-
-    std::string str = stream_->str();
-    std::vector<std::string> lines;
-    split(str, &lines, "\n");
-
-    ASSERT_EQ(lines.size(), 6u);
-
-    for (std::size_t i = 0; i < lines.size(); i++) {
-        char preface[16];
-        std::snprintf(preface, sizeof(preface),
-                      "abort[%zu]:", std::size_t(0));
-        EXPECT_EQ(lines[i].find(preface), 0);
-        if (i == 5) {
-            EXPECT_NE(lines[i].find("depth = 5"), std::string::npos)
-                << "lines[" << i << "] = '" << std::string(lines[i]) << "'";
-        } else {
-            EXPECT_NE(lines[i].find("ABORT"), std::string::npos)
-                << "lines[" << i << "] = '" << std::string(lines[i]) << "'";
-        }
-    }
-}
-
-TEST_F(AbortTest, ABORT_IF) {
-    ASSERT_TRUE(stream_);
-    diagnostics::set_ostream(stream_);
-    abort_if(0);
-
-    std::string str = stream_->str();
-    std::vector<std::string> lines;
-    split(str, &lines, "\n");
-
-    ASSERT_EQ(lines.size(), 6u);
-
-    for (std::size_t i = 0; i < lines.size(); i++) {
-        char preface[16];
-        std::snprintf(preface, sizeof(preface),
-                      "abort[%zu]:", lines.size()-i-1);
-        EXPECT_EQ(lines[i].find(preface), 0);
-        if (i == 0) {
-            EXPECT_NE(lines[i].find("depth = 5"), std::string::npos)
-                << "lines[" << i << "] = '" << std::string(lines[i]) << "'";
-        } else {
-            EXPECT_NE(lines[i].find("ABORT_IF"), std::string::npos)
-                << "lines[" << i << "] = '" << std::string(lines[i]) << "'";
-        }
-    }
-}
+INSTANTIATE_TEST_SUITE_P(
+    AbortMacros, AbortStackTest,
+    ::testing::Values(
+        AbortCase{&AbortTest::abort_if_not, "ABORT_IF_NOT", false},
+        AbortCase{&AbortTest::abort,        "ABORT",        true},
+        AbortCase{&AbortTest::abort_if,     "ABORT_IF",     false}),
+    [](const ::testing::TestParamInfo<AbortCase>& info) {
+        return std::string(info.param.macro_name);
+    });
 
 TEST_F(AbortTest, set_message_size) {
-    ASSERT_TRUE(stream_);
-    diagnostics::set_ostream(stream_);
-
     auto y = []() {
         ABORT(0, "hello");
     };
 
+    /* One pre-reserved snapshot string is recycled across the loop:
+     * swapping with the sink hands each iteration its message without
+     * copying, and the cleared sink keeps its capacity
+     */
+    std::string snapshot;
+    snapshot.reserve(256);
+
     for (std::size_t i = 0; i <= 5; i++) {
         diagnostics::set_message_size(i);
 
         y();
 
-        std::string str = stream_->str();
+        snapshot.swap(buf_.s);
+        buf_.s.clear();
+        buf_.s.reserve(256);
 
-        auto colonInd = str.rfind(":");     // message starts after ':'
-        ASSERT_NE(colonInd, std::string::npos);
+        auto colonInd = rfind_char(snapshot, ':');
+        ASSERT_NE(colonInd, std::string::npos);  // message follows ':'
 
-        auto substr = trim(str.substr(colonInd+1));
-        EXPECT_EQ(substr.size()-1, i)       // excluding null terminator
+        auto substr = trim(std::string_view(snapshot).substr(colonInd+1));
+        EXPECT_EQ(substr.size(), i)
             << "substr = " << substr;
 
         EXPECT_EQ(std::string("hello").substr(0, i),
-                  substr.c_str());
+                  substr);
     }
+
+    /* Restore a generous limit so later tests are not truncated */
+    diagnostics::set_message_size(1024);
 }
 
 TEST_F(AbortTest, ABORT_ON_ERRNO) {
-    ASSERT_TRUE(stream_);
-    diagnostics::set_ostream(stream_);
-
     // Simulate a system call that returns -1 and sets errno to 5
     auto sys_call = []() {
         errno = 5;
@@ -262,9 +440,12 @@ TEST_F(AbortTest, ABORT_ON_ERRNO) {
 
     y();
 
-    std::string str = stream_->str();
+    /* The sink is not written during verification, so a view of its
+     * buffer is a stable zero-copy snapshot
+     */
+    std::string_view str = buf_.s;
 
-    auto colonInd = str.rfind(":");   // message starts after ':'
+    auto colonInd = rfind_char(str, ':');  // message starts after ':'
     ASSERT_NE(colonInd, std::string::npos);
 
     auto substr = trim(str.substr(colonInd+1));
@@ -272,4 +453,50 @@ TEST_F(AbortTest, ABORT_ON_ERRNO) {
               std::string::npos);
 }
 
+TEST_F(AbortTest, set_enabled) {
+    // Simulate a system call that returns -1 and sets errno to 5
+    auto sys_call = []() {
+        errno = 5;
+        return -1;
+    };
+
+    auto y = [&]() {
+        ABORT_ON_ERRNO(sys_call(), -1);
+        return 0;
+    };
+
+    diagnostics::set_enabled(false);
+
+    /* A disabled abort still returns control to the caller... */
+    EXPECT_EQ(abort_if_not(5), -1);
+    EXPECT_EQ(abort(5),        -1);
+    EXPECT_EQ(abort_if(5),     -1);
+    EXPECT_EQ(y(),             -1);
+
+    /* ...but formats and emits nothing */
+    EXPECT_TRUE(buf_.s.empty())
+        << "sink = '" << buf_.s << "'";
+
+    diagnostics::set_enabled(true);
+
+    EXPECT_EQ(abort_if(5), -1);
+    EXPECT_NE(buf_.s.find("depth = 5"), std::string::npos);
+}
+
+TEST_F(AbortTest, flush) {
+    auto y = []() {
+        ABORT(0, "hello");
+    };
+
+    y();
+
+    /* The test sink is unbuffered, so this is a smoke test: flushing
+     * must forward to the installed stream without disturbing what
+     * was already written
+     */
+    diagnostics::flush();
+
+    EXPECT_NE(buf_.s.find("hello"), std::string::npos);
+}
+
 }  // namespace
@@ -1,6 +1,9 @@
+#include <ios>
+
 #include "gtest/gtest.h"
 
 int main(int argc, char** argv) {
+    std::ios::sync_with_stdio(false);
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
 }